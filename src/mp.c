@@ -16,12 +16,25 @@
 
 // Mandelbrot Generator
 
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <getopt.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __APPLE__
@@ -45,89 +58,1637 @@
 
 #endif
 
+enum { KERNEL_DOUBLE, KERNEL_FIXED };
+
 typedef struct {
   unsigned char *framebuffer;
   double rlo, ilo, stepu, stepv;
   unsigned int xres;
   int *c, maxit, ncolor;
   unsigned int *tr, *tg, *tb;
+  // View in fixed point, for KERNEL_FIXED.
+  int kernel;
+  int64_t frlo, filo, fstepu, fstepv;
 } Global_var;
 
+// Append-only journal of finished tiles and their iteration counts.
+typedef struct {
+  int fd, failed;
+  time_t last_sync;
+  pthread_mutex_t lock;
+} Journal;
+
+// Threads pull tiles of tile_rows rows off this queue until it runs dry.
+// Tiles marked in done were restored from a checkpoint and only need color.
+typedef struct {
+  unsigned int yres, tile_rows, ntiles;
+  atomic_uint next, active;
+  unsigned char *done;
+  Journal *journal;
+} Tile_queue;
+
+// Rows computed by one thread. Each counter gets its own cache line so
+// threads bumping their own counter don't contend with each other.
+typedef struct {
+  _Alignas(64) atomic_ulong rows;
+} Progress_counter;
+
+enum { PROGRESS_NONE, PROGRESS_TEXT, PROGRESS_JSON };
+
+typedef struct {
+  int format;
+  unsigned long total;
+  struct timespec start, last;
+} Progress;
+
 typedef struct {
   Global_var gv;
-  int ymin, ymax;
+  Tile_queue *tq;
+  Progress_counter *progress;
   int id, j;
   pthread_t th;
 } Thread_arg;
 
+// Signal that asked us to stop, or 0. Renderers stop taking new tiles once
+// it is set and the rows finished so far are written out.
+static atomic_int cancel_signal;
+
 void write_BMP_header(FILE *stream, unsigned int filesize, unsigned int xres,
                       unsigned int yres);
 
-void *threaded_mp(void *arg) {
-  Thread_arg *ta = (Thread_arg *)arg;
-  int *c = ta->gv.c, ncolor = ta->gv.ncolor, maxit = ta->gv.maxit, i, j, index;
-  unsigned int x, y, xres = ta->gv.xres, ymin = ta->ymin, ymax = ta->ymax, r, g,
-                     b, *tr = ta->gv.tr, *tg = ta->gv.tg, *tb = ta->gv.tb;
-  double u, v, rlo = ta->gv.rlo, r1, i1, r2, i2, stepu = ta->gv.stepu,
-               stepv = ta->gv.stepv;
-  unsigned char *framebuffer = ta->gv.framebuffer;
-
-  v = ta->gv.ilo + ta->id * stepv * (ymax - ymin);
-  i = ymin * xres;
-  j = maxit;
+/* Fixed-point kernel. Coordinates are 64-bit integers with FIX_FRAC
+ * fractional bits, squares and products are taken in 128-bit integers. Every
+ * operation is exact or truncates the same way on any machine, so unlike the
+ * double kernel (built with -Ofast -march=native, which lets the compiler use
+ * FMA or not depending on the host) it renders the same image everywhere.
+ * Values up to 128 in magnitude are representable: z stays below 6 as long
+ * as it is iterated, and points further than 2 from the origin are known to
+ * escape after one iteration, so only c itself needs range checking. */
+
+#define FIX_FRAC 56
+#define FIX_ONE ((double)((int64_t)1 << FIX_FRAC))
+// Views must stay within this distance of the origin.
+#define FIX_RANGE 64.0
+
+__extension__ typedef __int128 fix_wide;
+
+// Set up gv's fixed-point view. Returns -1 if it is out of range.
+int set_fixed_view(Global_var *gv, double rlo, double rhi, double ilo,
+                   double ihi, unsigned int xres, unsigned int yres) {
+  int64_t frhi, fihi;
+
+  if (rlo <= -FIX_RANGE || rhi >= FIX_RANGE || ilo <= -FIX_RANGE ||
+      ihi >= FIX_RANGE || rlo != rlo || rhi != rhi || ilo != ilo || ihi != ihi)
+    return -1;
+  // Scaling by a power of two is exact, so only the truncation to an
+  // integer rounds, and it does so identically everywhere.
+  gv->frlo = (int64_t)(rlo * FIX_ONE);
+  gv->filo = (int64_t)(ilo * FIX_ONE);
+  frhi = (int64_t)(rhi * FIX_ONE);
+  fihi = (int64_t)(ihi * FIX_ONE);
+  gv->fstepu = (frhi - gv->frlo) / (int64_t)xres;
+  gv->fstepv = (fihi - gv->filo) / (int64_t)yres;
+  return 0;
+}
+
+// escape_rows() for KERNEL_FIXED, counting iterations the same way.
+int escape_rows_fixed(const Global_var *gv, unsigned int ymin,
+                      unsigned int ymax, int *c) {
+  const fix_wide four = (fix_wide)4 << (2 * FIX_FRAC);
+  int maxit = gv->maxit, i, j, n;
+  unsigned int x, y, xres = gv->xres;
+  int64_t u, v, r1, i1;
+  fix_wide rr, ii;
+
+  i = 0;
+  j = maxit;
+
+  for (y = ymin; y < ymax; y++) {
+    v = gv->filo + (int64_t)y * gv->fstepv;
+    for (x = 0; x < xres; x++) {
+      u = gv->frlo + (int64_t)x * gv->fstepu;
+      r1 = u;
+      i1 = v;
+      rr = (fix_wide)r1 * r1;
+      ii = (fix_wide)i1 * i1;
+
+      if (rr + ii >= four) {
+        // |c| >= 2 escapes after the first iteration.
+        n = maxit >= 0 ? 1 : 0;
+      } else {
+        // rr and ii hold the squares of z; the first value tested is 0.
+        n = 0;
+        do {
+          i1 = (int64_t)(((fix_wide)r1 * i1) >> (FIX_FRAC - 1)) + v;
+          r1 = (int64_t)((rr - ii) >> FIX_FRAC) + u;
+          n++;
+          rr = (fix_wide)r1 * r1;
+          ii = (fix_wide)i1 * i1;
+        } while (rr + ii < four && n <= maxit);
+      }
+      c[i] = n;
+      j = n < j ? n : j;
+      i++;
+    }
+  }
+  return j;
+}
+
+// Compute iteration counts for rows [ymin, ymax). c points to the count of
+// the first pixel of row ymin. If z is not NULL, the last value of z for each
+// pixel is stored there (real, imaginary) so iteration can be resumed; this
+// is not supported by the fixed-point kernel.
+// Returns the minimum number of iterations taken.
+int escape_rows(const Global_var *gv, unsigned int ymin, unsigned int ymax,
+                int *c, double *z) {
+  int maxit = gv->maxit, i, j;
+  unsigned int x, y, xres = gv->xres;
+  double u, v, rlo = gv->rlo, r1, i1, r2, i2, stepu = gv->stepu;
+
+  if (gv->kernel == KERNEL_FIXED)
+    return escape_rows_fixed(gv, ymin, ymax, c);
+
+  i = 0;
+  j = maxit;
+
+  for (y = ymin; y < ymax; y++) {
+    // Derive u and v from the pixel position rather than accumulating them,
+    // so a pixel renders the same whichever thread, tile or process
+    // computes it.
+    v = gv->ilo + y * gv->stepv;
+    for (x = 0; x < xres; x++) {
+      u = rlo + x * stepu;
+      r1 = u;
+      i1 = v;
+
+      // Iterate until either maxit is reached, or abs value > 2.0.
+      // c array counts iterations.
+      c[i] = 0;
+      r2 = 0.0;
+      i2 = 0.0;
+      while (r2 * r2 + i2 * i2 < 4.0 && c[i] <= maxit) {
+        r2 = r1 * r1 - i1 * i1 + u;
+        i2 = 2.0 * i1 * r1 + v;
+        c[i]++;
+        r1 = r2;
+        i1 = i2;
+      }
+      if (z != NULL) {
+        z[2 * i] = r1;
+        z[2 * i + 1] = i1;
+      }
+      // Find minimum number of iterations taken.
+      // in order to scale color range.
+      j = c[i] < j ? c[i] : j;
+      i++;
+    }
+  }
+  return j;
+}
+
+// Assign a color to each of the nrows * xres pixels counted in c, writing
+// BGR triplets to framebuffer.
+void color_rows(const Global_var *gv, const int *c, unsigned int nrows,
+                unsigned char *framebuffer) {
+  int maxit = gv->maxit, ncolor = gv->ncolor, index;
+  unsigned int i, j, n = nrows * gv->xres, r, g, b, *tr = gv->tr, *tg = gv->tg,
+                     *tb = gv->tb;
+
+  j = 0;
+  for (i = 0; i < n; i++) {
+    if (c[i] > maxit) {
+      r = 0;
+      g = 0;
+      b = 0;
+    } else {
+      index = c[i] % ncolor;
+      r = tr[index];
+      g = tg[index];
+      b = tb[index];
+    }
+
+    // Write pixel to file(RGB).
+    framebuffer[j++] = (unsigned char)b;
+    framebuffer[j++] = (unsigned char)g;
+    framebuffer[j++] = (unsigned char)r;
+  }
+}
+
+int read_full(int fd, void *buf, size_t len) {
+  unsigned char *p = (unsigned char *)buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+  const unsigned char *p = (const unsigned char *)buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite(fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/* Checkpointing. The journal starts with a header describing the view, then
+ * holds one record per finished tile: the tile number, a checksum, and the
+ * tile's iteration counts. Records are appended as tiles finish and fsync()ed
+ * at most every CHECKPOINT_SYNC_INTERVAL seconds, so a crash loses at most
+ * that much work. A torn record at the end of the file is discarded when
+ * resuming. */
+
+#define CHECKPOINT_SYNC_INTERVAL 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version, xres, yres, maxit, tile_rows, kernel;
+  double rlo, ilo, stepu, stepv;
+} Journal_header;
+
+typedef struct {
+  uint32_t tile, checksum;
+} Journal_record;
+
+// FNV-1a over a tile's counts, seeded with the tile number.
+uint32_t tile_checksum(uint32_t tile, const int *c, size_t n) {
+  const unsigned char *p = (const unsigned char *)c;
+  uint32_t h = 2166136261u ^ tile;
+  size_t i;
+
+  for (i = 0; i < n * sizeof(int); i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+void journal_fill_header(Journal_header *h, const Global_var *gv,
+                         unsigned int yres, unsigned int tile_rows) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "MPCK", 4);
+  h->version = 2;
+  h->xres = gv->xres;
+  h->yres = yres;
+  h->maxit = gv->maxit;
+  h->tile_rows = tile_rows;
+  h->kernel = gv->kernel;
+  h->rlo = gv->rlo;
+  h->ilo = gv->ilo;
+  h->stepu = gv->stepu;
+  h->stepv = gv->stepv;
+}
+
+// Open the checkpoint at path and set up tq->done. When resuming from an
+// existing journal, restore its tiles into gv->c, adopt its tile size and
+// truncate any partially written record; otherwise start a new journal.
+Journal *journal_open(const char *path, int resume, const Global_var *gv,
+                      unsigned int yres, Tile_queue *tq) {
+  Journal_header want, have;
+  Journal_record rec;
+  Journal *jn;
+  off_t end;
+  size_t n;
+  unsigned int restored = 0, ymin, ymax;
+  int fd = -1;
+
+  if (resume)
+    fd = open(path, O_RDWR);
+  if (fd >= 0) {
+    if (read_full(fd, &have, sizeof(have)) < 0 ||
+        memcmp(have.magic, "MPCK", 4) != 0 || have.tile_rows == 0) {
+      fprintf(stderr, "%s is not a checkpoint file\n", path);
+      exit(EXIT_FAILURE);
+    }
+    journal_fill_header(&want, gv, yres, have.tile_rows);
+    if (memcmp(&want, &have, sizeof(want)) != 0) {
+      fprintf(stderr, "Checkpoint %s was taken for a different view\n", path);
+      exit(EXIT_FAILURE);
+    }
+    tq->tile_rows = have.tile_rows;
+  } else if (resume && errno != ENOENT) {
+    perror("Error opening checkpoint file");
+    exit(EXIT_FAILURE);
+  }
+
+  tq->ntiles = (yres + tq->tile_rows - 1) / tq->tile_rows;
+  if ((tq->done = (unsigned char *)calloc(tq->ntiles, 1)) == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fd >= 0) {
+    // Replay complete records; stop at the first torn or corrupt one.
+    end = sizeof(have);
+    while (read_full(fd, &rec, sizeof(rec)) == 0 && rec.tile < tq->ntiles) {
+      ymin = rec.tile * tq->tile_rows;
+      ymax = ymin + tq->tile_rows < yres ? ymin + tq->tile_rows : yres;
+      n = (size_t)(ymax - ymin) * gv->xres;
+      if (read_full(fd, gv->c + (size_t)ymin * gv->xres, n * sizeof(int)) <
+              0 ||
+          tile_checksum(rec.tile, gv->c + (size_t)ymin * gv->xres, n) !=
+              rec.checksum)
+        break;
+      if (!tq->done[rec.tile]) {
+        tq->done[rec.tile] = 1;
+        restored++;
+      }
+      end += sizeof(rec) + n * sizeof(int);
+    }
+    if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0) {
+      perror("Error truncating checkpoint file");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Resuming from %s: %u of %u tiles already done\n", path,
+            restored, tq->ntiles);
+  } else {
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+      perror("Error creating checkpoint file");
+      exit(EXIT_FAILURE);
+    }
+    journal_fill_header(&want, gv, yres, tq->tile_rows);
+    if (write_full(fd, &want, sizeof(want)) < 0 || fsync(fd) < 0) {
+      perror("Error writing checkpoint file");
+      exit(EXIT_FAILURE);
+    }
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if ((jn = (Journal *)malloc(sizeof(Journal))) == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  jn->fd = fd;
+  jn->failed = 0;
+  jn->last_sync = time(NULL);
+  pthread_mutex_init(&jn->lock, NULL);
+  return jn;
+}
+
+// Record a finished tile. Failing to checkpoint is not worth losing the
+// render over, so errors only disable the journal. The fd stays open until
+// journal_close() so a sync started outside the lock never sees it closed.
+void journal_append(Journal *jn, uint32_t tile, const int *c, size_t n) {
+  Journal_record rec;
+  time_t now;
+  int sync = 0;
+
+  rec.tile = tile;
+  rec.checksum = tile_checksum(tile, c, n);
+
+  pthread_mutex_lock(&jn->lock);
+  if (!jn->failed) {
+    if (write_full(jn->fd, &rec, sizeof(rec)) < 0 ||
+        write_full(jn->fd, c, n * sizeof(int)) < 0) {
+      perror("Error writing checkpoint file, checkpointing disabled");
+      jn->failed = 1;
+    } else if ((now = time(NULL)) - jn->last_sync >=
+               CHECKPOINT_SYNC_INTERVAL) {
+      jn->last_sync = now;
+      sync = 1;
+    }
+  }
+  pthread_mutex_unlock(&jn->lock);
+
+  // The other threads keep appending while this one waits on the disk.
+  if (sync)
+    fdatasync(jn->fd);
+}
+
+void journal_close(Journal *jn) {
+  if (!jn->failed)
+    fsync(jn->fd);
+  close(jn->fd);
+  pthread_mutex_destroy(&jn->lock);
+  free(jn);
+}
+
+void on_cancel(int sig) { atomic_store(&cancel_signal, sig); }
+
+// Stop rendering on SIGINT/SIGTERM. A second signal kills the process.
+void install_cancel_handler(void) {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_cancel;
+  sa.sa_flags = SA_RESETHAND;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+double elapsed_s(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void progress_start(Progress *p, int format, unsigned long total) {
+  p->format = format;
+  p->total = total;
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+  p->last = p->start;
+}
+
+// Report rows done so far, at most once a second unless final.
+void progress_report(Progress *p, unsigned long done, int final) {
+  struct timespec now;
+  double elapsed, eta;
+  const char *state;
+
+  if (p->format == PROGRESS_NONE)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!final && elapsed_s(&p->last, &now) < 1.0)
+    return;
+  p->last = now;
+
+  elapsed = elapsed_s(&p->start, &now);
+  eta = done > 0 ? elapsed * (p->total - done) / done : -1.0;
+  if (p->format == PROGRESS_JSON) {
+    state = !final                         ? "running"
+            : atomic_load(&cancel_signal) ? "cancelled"
+                                           : "done";
+    fprintf(stderr,
+            "{\"state\":\"%s\",\"rows_done\":%lu,\"rows_total\":%lu,"
+            "\"elapsed_ms\":%.0f,\"eta_ms\":",
+            state, done, p->total, elapsed * 1e3);
+    // There is no estimate until the first rows are done.
+    if (eta >= 0)
+      fprintf(stderr, "%.0f}\n", eta * 1e3);
+    else
+      fputs("null}\n", stderr);
+  } else {
+    fprintf(stderr, "\r%5.1f%% (%lu/%lu rows), %.0fs elapsed",
+            p->total > 0 ? 100.0 * done / p->total : 100.0, done, p->total,
+            elapsed);
+    if (!final && eta >= 0)
+      fprintf(stderr, ", ETA %.0fs", eta);
+    fputs(final ? "\n" : "\033[K", stderr);
+  }
+}
+
+void *threaded_mp(void *arg) {
+  Thread_arg *ta = (Thread_arg *)arg;
+  Tile_queue *tq = ta->tq;
+  unsigned int tile, xres = ta->gv.xres, ymin, ymax;
+  int j, *c;
+
+  ta->j = ta->gv.maxit;
+  while (!atomic_load(&cancel_signal) &&
+         (tile = atomic_fetch_add(&tq->next, 1)) < tq->ntiles) {
+    ymin = tile * tq->tile_rows;
+    ymax = ymin + tq->tile_rows < tq->yres ? ymin + tq->tile_rows : tq->yres;
+    c = ta->gv.c + (size_t)ymin * xres;
+
+    if (!tq->done[tile]) {
+      j = escape_rows(&ta->gv, ymin, ymax, c, NULL);
+      ta->j = j < ta->j ? j : ta->j;
+      if (tq->journal != NULL)
+        journal_append(tq->journal, tile, c, (size_t)(ymax - ymin) * xres);
+    }
+    color_rows(&ta->gv, c, ymax - ymin,
+               ta->gv.framebuffer + 3 * (size_t)xres * ymin);
+    if (!tq->done[tile])
+      atomic_fetch_add_explicit(&ta->progress->rows, ymax - ymin,
+                                memory_order_relaxed);
+  }
+  atomic_fetch_sub(&tq->active, 1);
+  pthread_exit(NULL);
+}
+
+// Render the tiles in tq with nthreads threads, reporting progress in the
+// given format until they are done.
+void render_threads(const Global_var *gv, Tile_queue *tq, unsigned int nthreads,
+                    int progress_format) {
+  Thread_arg *ta = (Thread_arg *)alloca(sizeof(Thread_arg) * nthreads);
+  Progress_counter *counters;
+  Progress progress;
+  struct timespec tick = {0, 100000000};
+  unsigned long rows_done, rows_left;
+  unsigned int i;
+  int finished;
+
+  // Only count rows that still have to be computed.
+  rows_left = tq->yres;
+  for (i = 0; i < tq->ntiles; i++)
+    if (tq->done[i])
+      rows_left -= (i + 1) * tq->tile_rows < tq->yres
+                       ? tq->tile_rows
+                       : tq->yres - i * tq->tile_rows;
+  progress_start(&progress, progress_format, rows_left);
+
+  counters = (Progress_counter *)aligned_alloc(
+      sizeof(Progress_counter), nthreads * sizeof(Progress_counter));
+  if (counters == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  atomic_init(&tq->active, nthreads);
+  for (i = 0; i < nthreads; i++) {
+    atomic_init(&counters[i].rows, 0);
+    ta[i].gv = *gv;
+    ta[i].tq = tq;
+    ta[i].progress = &counters[i];
+    ta[i].id = i;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&ta[i].th, NULL, &threaded_mp, (void *)&ta[i]) != 0) {
+      perror("Error launching thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Report progress until the last thread is done.
+  while (progress.format != PROGRESS_NONE) {
+    nanosleep(&tick, NULL);
+    finished = atomic_load(&tq->active) == 0;
+    for (rows_done = 0, i = 0; i < nthreads; i++)
+      rows_done += atomic_load_explicit(&counters[i].rows,
+                                        memory_order_relaxed);
+    progress_report(&progress, rows_done, finished);
+    if (finished)
+      break;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_join(ta[i].th, NULL) != 0) {
+      perror("Error joining thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(counters);
+}
+
+/* Time-budget rendering. The whole image is first rendered at a low maxit,
+ * keeping the last value of z for every pixel. Pixels that have not escaped
+ * are then iterated further in rounds, doubling maxit each round, until the
+ * deadline passes or the requested maxit is reached. Each round resumes from
+ * the saved z, so the counts are those of a render made directly at that
+ * maxit (short of the odd pixel where the compiler contracts the two loops
+ * into FMAs differently). Within a round, pixels next to an escaped pixel
+ * (the boundary of the set, where extra iterations change the picture) are
+ * done first. */
+
+// maxit of the first pass. It cannot stop at the deadline without leaving
+// holes, so it is kept as cheap as possible and the rounds do the rest.
+#define BUDGET_FIRST_ITER 8
+// maxit used when --budget-ms is given without --iter.
+#define BUDGET_MAX_ITER (1 << 30)
+// Iterations a thread does between checks of the clock.
+#define BUDGET_SLICE 65536
+
+typedef struct {
+  Global_var gv;
+  Tile_queue *tq;
+  double *z;
+  // The first nedge entries of active are on the boundary.
+  unsigned int *active, nactive, nedge, chunk;
+  // Per tile lists of active pixels, boundary then interior, and their sizes.
+  unsigned int *scratch, *nedges, *ninner;
+  atomic_uint next, edge_done;
+  atomic_int expired;
+  int target;
+  struct timespec deadline;
+} Budget;
+
+int budget_expired(Budget *b) {
+  struct timespec now;
+
+  if (atomic_load_explicit(&b->expired, memory_order_relaxed))
+    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (elapsed_s(&b->deadline, &now) < 0 && !atomic_load(&cancel_signal))
+    return 0;
+  atomic_store(&b->expired, 1);
+  return 1;
+}
+
+// First pass: every pixel at gv.maxit, saving z.
+void *budget_first_pass(void *arg) {
+  Budget *b = (Budget *)arg;
+  Tile_queue *tq = b->tq;
+  unsigned int tile, ymin, ymax;
+  size_t off;
+
+  while (!atomic_load(&cancel_signal) &&
+         (tile = atomic_fetch_add(&tq->next, 1)) < tq->ntiles) {
+    ymin = tile * tq->tile_rows;
+    ymax = ymin + tq->tile_rows < tq->yres ? ymin + tq->tile_rows : tq->yres;
+    off = (size_t)ymin * b->gv.xres;
+    escape_rows(&b->gv, ymin, ymax, b->gv.c + off, b->z + 2 * off);
+  }
+  pthread_exit(NULL);
+}
+
+// Later passes: take the still active pixels up to b->target iterations.
+void *budget_refine(void *arg) {
+  Budget *b = (Budget *)arg;
+  unsigned int k, kmax, p, xres = b->gv.xres, edge_done;
+  int n, limit, target = b->target;
+  double u, v, r1, i1, r2, i2;
+
+  while (!budget_expired(b) &&
+         (k = atomic_fetch_add(&b->next, b->chunk)) < b->nactive) {
+    kmax = k + b->chunk < b->nactive ? k + b->chunk : b->nactive;
+    edge_done = 0;
+    for (; k < kmax; k++) {
+      p = b->active[k];
+      u = b->gv.rlo + (p % xres) * b->gv.stepu;
+      v = b->gv.ilo + (p / xres) * b->gv.stepv;
+      r1 = b->z[2 * p];
+      i1 = b->z[2 * p + 1];
+      n = b->gv.c[p];
+
+      // Same loop as escape_rows(), picked up where it stopped, cut into
+      // slices so a single deep pixel cannot overrun the deadline.
+      do {
+        limit = target - n > BUDGET_SLICE ? n + BUDGET_SLICE : target;
+        r2 = r1;
+        i2 = i1;
+        while (r2 * r2 + i2 * i2 < 4.0 && n <= limit) {
+          r2 = r1 * r1 - i1 * i1 + u;
+          i2 = 2.0 * i1 * r1 + v;
+          n++;
+          r1 = r2;
+          i1 = i2;
+        }
+      } while (r1 * r1 + i1 * i1 < 4.0 && n <= target && !budget_expired(b));
+
+      b->z[2 * p] = r1;
+      b->z[2 * p + 1] = i1;
+      b->gv.c[p] = n;
+      if (k < b->nedge && (n > target || r1 * r1 + i1 * i1 >= 4.0))
+        edge_done++;
+    }
+    atomic_fetch_add_explicit(&b->edge_done, edge_done, memory_order_relaxed);
+  }
+  pthread_exit(NULL);
+}
+
+void budget_run(Budget *b, void *(*pass)(void *), unsigned int nthreads) {
+  pthread_t *th = (pthread_t *)alloca(nthreads * sizeof(pthread_t));
+  unsigned int i;
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&th[i], NULL, pass, (void *)b) != 0) {
+      perror("Error launching thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_join(th[i], NULL) != 0) {
+      perror("Error joining thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int still_active(const double *z, unsigned int p) {
+  return z[2 * p] * z[2 * p] + z[2 * p + 1] * z[2 * p + 1] < 4.0;
+}
+
+// List the pixels of each tile that have not escaped, boundary pixels first,
+// at the tile's offset in b->scratch.
+void *budget_classify(void *arg) {
+  Budget *b = (Budget *)arg;
+  Tile_queue *tq = b->tq;
+  unsigned int tile, x, y, ymin, ymax, p, xres = b->gv.xres, yres = tq->yres;
+  unsigned int *edges, *inner, nedge;
+
+  while ((tile = atomic_fetch_add(&b->next, 1)) < tq->ntiles) {
+    ymin = tile * tq->tile_rows;
+    ymax = ymin + tq->tile_rows < yres ? ymin + tq->tile_rows : yres;
+    edges = b->scratch + (size_t)ymin * xres;
+    inner = b->scratch + (size_t)ymax * xres;
+    nedge = 0;
+    for (y = ymin; y < ymax; y++) {
+      for (x = 0; x < xres; x++) {
+        p = y * xres + x;
+        if (!still_active(b->z, p))
+          continue;
+        // Interior pixels fill the tile's slot from the end, in reverse.
+        if ((x > 0 && !still_active(b->z, p - 1)) ||
+            (x + 1 < xres && !still_active(b->z, p + 1)) ||
+            (y > 0 && !still_active(b->z, p - xres)) ||
+            (y + 1 < yres && !still_active(b->z, p + xres)))
+          edges[nedge++] = p;
+        else
+          *--inner = p;
+      }
+    }
+    b->nedges[tile] = nedge;
+    b->ninner[tile] = (unsigned int)(b->scratch + (size_t)ymax * xres - inner);
+  }
+  pthread_exit(NULL);
+}
+
+// Copy each tile's lists to their place in b->active, whose first entries
+// were set aside for the boundary pixels of the tiles before it. nedges and
+// ninner hold those offsets by then.
+void *budget_gather(void *arg) {
+  Budget *b = (Budget *)arg;
+  Tile_queue *tq = b->tq;
+  unsigned int tile, i, ymin, ymax, xres = b->gv.xres, *inner, *to;
+
+  while ((tile = atomic_fetch_add(&b->next, 1)) < tq->ntiles) {
+    ymin = tile * tq->tile_rows;
+    ymax = ymin + tq->tile_rows < tq->yres ? ymin + tq->tile_rows : tq->yres;
+    memcpy(b->active + b->nedges[tile], b->scratch + (size_t)ymin * xres,
+           (b->nedges[tile + 1] - b->nedges[tile]) * sizeof(unsigned int));
+    inner = b->scratch + (size_t)ymax * xres;
+    to = b->active + b->ninner[tile];
+    for (i = b->ninner[tile + 1] - b->ninner[tile]; i > 0; i--)
+      *to++ = *--inner;
+  }
+  pthread_exit(NULL);
+}
+
+// Rebuild the list of pixels that have not escaped, boundary pixels first,
+// in the same order as a scan of the whole image would give.
+void budget_collect(Budget *b, unsigned int nthreads) {
+  unsigned int tile, ntiles = b->tq->ntiles, nedge = 0, n;
+
+  atomic_init(&b->next, 0);
+  budget_run(b, budget_classify, nthreads);
+
+  // Turn the counts into offsets, with one more entry for the end.
+  for (tile = 0; tile < ntiles; tile++) {
+    n = b->nedges[tile];
+    b->nedges[tile] = nedge;
+    nedge += n;
+  }
+  b->nedges[ntiles] = nedge;
+  b->nactive = nedge;
+  for (tile = 0; tile <= ntiles; tile++) {
+    n = tile < ntiles ? b->ninner[tile] : 0;
+    b->ninner[tile] = b->nactive;
+    b->nactive += n;
+  }
+  b->nedge = nedge;
+
+  atomic_init(&b->next, 0);
+  budget_run(b, budget_gather, nthreads);
+}
+
+// Fill gv->c for the view within budget_ms milliseconds, going no further
+// than gv->maxit iterations. On return gv->maxit is the maxit the counts
+// should be colored with and *boundary the highest maxit every boundary pixel
+// was taken to; the return value is the highest maxit every pixel was taken
+// to.
+int render_budget(Global_var *gv, Tile_queue *tq, unsigned int yres,
+                  unsigned int nthreads, unsigned int budget_ms,
+                  int *boundary) {
+  Budget b;
+  size_t npix = (size_t)gv->xres * yres, p;
+  unsigned int rows, k;
+  int maxit = gv->maxit, effective;
+
+  clock_gettime(CLOCK_MONOTONIC, &b.deadline);
+  b.deadline.tv_sec += budget_ms / 1000;
+  b.deadline.tv_nsec += (budget_ms % 1000) * 1000000L;
+  if (b.deadline.tv_nsec >= 1000000000L) {
+    b.deadline.tv_sec++;
+    b.deadline.tv_nsec -= 1000000000L;
+  }
+
+  b.gv = *gv;
+  b.tq = tq;
+  b.z = (double *)malloc(2 * npix * sizeof(double));
+  b.active = (unsigned int *)malloc(npix * sizeof(unsigned int));
+  b.scratch = (unsigned int *)malloc(npix * sizeof(unsigned int));
+  b.nedges = (unsigned int *)malloc((tq->ntiles + 1) * sizeof(unsigned int));
+  b.ninner = (unsigned int *)malloc((tq->ntiles + 1) * sizeof(unsigned int));
+  if (b.z == NULL || b.active == NULL || b.scratch == NULL ||
+      b.nedges == NULL || b.ninner == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  atomic_init(&b.expired, 0);
+
+  b.gv.maxit = maxit < BUDGET_FIRST_ITER ? maxit : BUDGET_FIRST_ITER;
+  budget_run(&b, budget_first_pass, nthreads);
+  effective = *boundary = b.target = b.gv.maxit;
+
+  // Rows a cancelled first pass never reached are taken to be in the set, so
+  // they come out black like the rest of a cancelled render.
+  rows = atomic_load(&tq->next) * tq->tile_rows;
+  for (p = rows < yres ? (size_t)rows * gv->xres : npix; p < npix; p++)
+    gv->c[p] = b.target + 1;
+
+  // The first pass leaves the pixels that did not escape at b.target + 1, so
+  // if it used up the budget there is nothing left to do.
+  b.nactive = 0;
+  if (!budget_expired(&b))
+    budget_collect(&b, nthreads);
+  while (b.nactive > 0 && b.target < maxit && !budget_expired(&b)) {
+    b.target = b.target < maxit / 2 ? 2 * b.target : maxit;
+    // Hand out roughly BUDGET_SLICE iterations' worth of pixels at a time.
+    b.chunk = BUDGET_SLICE / (b.target / 2) + 1;
+    atomic_init(&b.next, 0);
+    atomic_init(&b.edge_done, 0);
+    budget_run(&b, budget_refine, nthreads);
+    // The boundary comes first, so it may be done even if the round is not.
+    if (atomic_load(&b.edge_done) == b.nedge)
+      *boundary = b.target;
+    if (budget_expired(&b))
+      break;
+    effective = b.target;
+    budget_collect(&b, nthreads);
+  }
+
+  // Whatever is left is taken to be in the set. Only pixels on the last list
+  // can still be active.
+  for (k = 0; k < b.nactive; k++)
+    if (still_active(b.z, b.active[k]))
+      gv->c[b.active[k]] = b.target + 1;
+  gv->maxit = b.target;
+
+  free(b.z);
+  free(b.active);
+  free(b.scratch);
+  free(b.nedges);
+  free(b.ninner);
+  return effective;
+}
+
+/* Pipelined rendering. Instead of each thread computing, then coloring its
+ * tiles and main() writing the whole framebuffer at the end, tiles flow
+ * through three stages, each with its own threads: compute (escape counts),
+ * color (BGR pixels, which for an uncompressed BMP is also the encoding) and
+ * write (pwrite() at the tile's offset in the file). Stages hand tiles over
+ * through bounded lock-free queues. A fixed set of tile buffers circulates
+ * through the stages, so a slow stage holds back the ones before it and the
+ * image never has to fit in memory. Per-stage busy time and queue occupancy
+ * are reported at the end to show which stage limits throughput. */
+
+// Tile buffers in flight per pipeline thread.
+#define PIPELINE_TILES_PER_THREAD 4
+
+typedef struct {
+  unsigned int ymin, ymax;
+  int *c;
+  unsigned char *bgr;
+} Pipeline_tile;
+
+typedef struct {
+  atomic_size_t seq;
+  Pipeline_tile *tile;
+} Ring_cell;
+
+// Bounded multi-producer multi-consumer queue of tiles (Vyukov's design):
+// each cell's sequence number says whether it is ready to be filled or
+// emptied at a given position, so producers and consumers only contend on
+// their own index. open counts the producers that have not finished yet.
+typedef struct {
+  Ring_cell *cells;
+  size_t mask;
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  _Alignas(64) atomic_uint open;
+  // Occupancy samples, only touched by the main thread.
+  double occupancy_sum;
+  size_t occupancy_max, samples;
+} Tile_ring;
+
+typedef struct {
+  const char *name;
+  unsigned int nthreads;
+  atomic_ulong tiles, busy_ns, wait_ns;
+} Pipeline_stage;
+
+typedef struct {
+  Global_var gv;
+  Tile_queue *tq;
+  int out_fd;
+  Tile_ring spare, to_color, to_write;
+  Pipeline_stage compute, color, write;
+  atomic_ulong rows_written;
+  atomic_uint active;
+  atomic_int failed;
+} Pipeline;
+
+void ring_init(Tile_ring *r, size_t capacity, unsigned int producers) {
+  size_t i, n = 1;
+
+  while (n < capacity)
+    n <<= 1;
+  if ((r->cells = (Ring_cell *)malloc(n * sizeof(Ring_cell))) == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++)
+    atomic_init(&r->cells[i].seq, i);
+  r->mask = n - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->open, producers);
+  r->occupancy_sum = 0;
+  r->occupancy_max = 0;
+  r->samples = 0;
+}
+
+// Returns -1 if the ring is full.
+int ring_push(Tile_ring *r, Pipeline_tile *t) {
+  size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed), seq;
+  Ring_cell *cell;
+
+  for (;;) {
+    cell = &r->cells[pos & r->mask];
+    seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if ((ptrdiff_t)(seq - pos) < 0) {
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    }
+  }
+  cell->tile = t;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+// Returns NULL if the ring is empty.
+Pipeline_tile *ring_pop(Tile_ring *r) {
+  size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed), seq;
+  Ring_cell *cell;
+  Pipeline_tile *t;
+
+  for (;;) {
+    cell = &r->cells[pos & r->mask];
+    seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+  }
+  t = cell->tile;
+  atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+  return t;
+}
+
+// Back off while a ring is empty or full: yield at first, then sleep so an
+// idle stage does not keep a core busy.
+void ring_wait(unsigned int *spins) {
+  struct timespec pause = {0, 100000};
+
+  if ((*spins)++ < 64)
+    sched_yield();
+  else
+    nanosleep(&pause, NULL);
+}
+
+void ring_put(Tile_ring *r, Pipeline_tile *t) {
+  unsigned int spins = 0;
+
+  while (ring_push(r, t) < 0)
+    ring_wait(&spins);
+}
+
+// Wait for a tile. Returns NULL once every producer is done and the ring
+// has been drained.
+Pipeline_tile *ring_get(Tile_ring *r) {
+  Pipeline_tile *t;
+  unsigned int spins = 0;
+
+  for (;;) {
+    if ((t = ring_pop(r)) != NULL)
+      return t;
+    // A producer pushes before it leaves, so look once more after the last
+    // one has left.
+    if (atomic_load(&r->open) == 0)
+      return ring_pop(r);
+    ring_wait(&spins);
+  }
+}
+
+unsigned long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void stage_account(Pipeline_stage *st, unsigned long t0, unsigned long t1,
+                   unsigned long t2) {
+  atomic_fetch_add_explicit(&st->tiles, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&st->wait_ns, t1 - t0, memory_order_relaxed);
+  atomic_fetch_add_explicit(&st->busy_ns, t2 - t1, memory_order_relaxed);
+}
+
+void *pipeline_compute(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  Tile_queue *tq = p->tq;
+  Pipeline_tile *t;
+  unsigned int tile;
+  unsigned long t0, t1;
+
+  while (!atomic_load(&cancel_signal) &&
+         (tile = atomic_fetch_add(&tq->next, 1)) < tq->ntiles) {
+    t0 = now_ns();
+    t = ring_get(&p->spare);
+    t1 = now_ns();
+    t->ymin = tile * tq->tile_rows;
+    t->ymax = t->ymin + tq->tile_rows < tq->yres ? t->ymin + tq->tile_rows
+                                                 : tq->yres;
+    escape_rows(&p->gv, t->ymin, t->ymax, t->c, NULL);
+    stage_account(&p->compute, t0, t1, now_ns());
+    ring_put(&p->to_color, t);
+  }
+  atomic_fetch_sub(&p->to_color.open, 1);
+  atomic_fetch_sub(&p->active, 1);
+  pthread_exit(NULL);
+}
+
+void *pipeline_color(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  Pipeline_tile *t;
+  unsigned long t0 = now_ns(), t1, t2;
+
+  while ((t = ring_get(&p->to_color)) != NULL) {
+    t1 = now_ns();
+    color_rows(&p->gv, t->c, t->ymax - t->ymin, t->bgr);
+    t2 = now_ns();
+    stage_account(&p->color, t0, t1, t2);
+    t0 = t2;
+    ring_put(&p->to_write, t);
+  }
+  atomic_fetch_sub(&p->to_write.open, 1);
+  atomic_fetch_sub(&p->active, 1);
+  pthread_exit(NULL);
+}
+
+void *pipeline_write(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  Pipeline_tile *t;
+  unsigned long t0 = now_ns(), t1, t2;
+
+  while ((t = ring_get(&p->to_write)) != NULL) {
+    t1 = now_ns();
+    if (!atomic_load(&p->failed) &&
+        pwrite_full(p->out_fd, t->bgr,
+                    3 * (size_t)p->gv.xres * (t->ymax - t->ymin),
+                    54 + 3 * (off_t)p->gv.xres * t->ymin) < 0) {
+      perror("Error writing bitmap file");
+      atomic_store(&p->failed, 1);
+    }
+    atomic_fetch_add(&p->rows_written, t->ymax - t->ymin);
+    t2 = now_ns();
+    stage_account(&p->write, t0, t1, t2);
+    t0 = t2;
+    ring_put(&p->spare, t);
+  }
+  atomic_fetch_sub(&p->active, 1);
+  pthread_exit(NULL);
+}
+
+void ring_sample(Tile_ring *r) {
+  size_t n = atomic_load(&r->head) - atomic_load(&r->tail);
+
+  // head and tail are read separately, so n can be off by a tile or two.
+  if (n > r->mask + 1)
+    n = 0;
+  r->occupancy_sum += n;
+  r->occupancy_max = n > r->occupancy_max ? n : r->occupancy_max;
+  r->samples++;
+}
+
+void stage_report(const Pipeline_stage *st, double wall) {
+  double busy = atomic_load(&st->busy_ns) / 1e9,
+         wait = atomic_load(&st->wait_ns) / 1e9;
+  unsigned long tiles = atomic_load(&st->tiles);
+
+  fprintf(stderr,
+          "  %-8s %2u threads  %5.1f%% busy  %6.2fs waiting for a tile  "
+          "%8.1f tiles/s when busy\n",
+          st->name, st->nthreads,
+          wall > 0 ? 100.0 * busy / (wall * st->nthreads) : 0.0, wait,
+          busy > 0 ? tiles * st->nthreads / busy : 0.0);
+}
+
+void ring_report(const char *name, const Tile_ring *r) {
+  fprintf(stderr, "  %-8s mean %5.2f  max %3lu  of %3lu tiles\n", name,
+          r->samples ? r->occupancy_sum / r->samples : 0.0,
+          (unsigned long)r->occupancy_max, (unsigned long)r->mask + 1);
+}
+
+// Render the tiles in tq through the pipeline, writing them to the BMP open
+// on out_fd. stage_threads gives the compute, color and write thread counts.
+// Returns -1 if writing failed.
+int render_pipeline(const Global_var *gv, Tile_queue *tq,
+                    const unsigned int stage_threads[3], int out_fd,
+                    int progress_format) {
+  Pipeline p;
+  Pipeline_stage *stages[3] = {&p.compute, &p.color, &p.write};
+  void *(*run[3])(void *) = {pipeline_compute, pipeline_color, pipeline_write};
+  const char *names[3] = {"compute", "color", "write"};
+  Pipeline_tile *tiles;
+  Progress progress;
+  pthread_t *th;
+  struct timespec tick = {0, 10000000};
+  unsigned long start, ticks = 0;
+  unsigned int i, k, nthreads = 0, ntiles;
+  size_t n = (size_t)gv->xres * tq->tile_rows;
+  double wall;
+  int finished;
+
+  for (k = 0; k < 3; k++) {
+    stages[k]->name = names[k];
+    stages[k]->nthreads = stage_threads[k];
+    atomic_init(&stages[k]->tiles, 0);
+    atomic_init(&stages[k]->busy_ns, 0);
+    atomic_init(&stages[k]->wait_ns, 0);
+    nthreads += stage_threads[k];
+  }
+  p.gv = *gv;
+  p.tq = tq;
+  p.out_fd = out_fd;
+  atomic_init(&p.rows_written, 0);
+  atomic_init(&p.active, nthreads);
+  atomic_init(&p.failed, 0);
+
+  // Every ring can hold all the tiles, so handing a tile on never blocks.
+  ntiles = PIPELINE_TILES_PER_THREAD * nthreads;
+  ring_init(&p.spare, ntiles, 1);
+  ring_init(&p.to_color, ntiles, stage_threads[0]);
+  ring_init(&p.to_write, ntiles, stage_threads[1]);
+  tiles = (Pipeline_tile *)malloc(ntiles * sizeof(Pipeline_tile));
+  th = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  if (tiles == NULL || th == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < ntiles; i++) {
+    tiles[i].c = (int *)malloc(n * sizeof(int));
+    tiles[i].bgr = (unsigned char *)malloc(3 * n);
+    if (tiles[i].c == NULL || tiles[i].bgr == NULL) {
+      perror("Error allocating memory");
+      exit(EXIT_FAILURE);
+    }
+    ring_put(&p.spare, &tiles[i]);
+  }
+
+  progress_start(&progress, progress_format, tq->yres);
+  start = now_ns();
+  for (i = k = 0; k < 3; k++) {
+    unsigned int j;
+
+    for (j = 0; j < stage_threads[k]; j++, i++) {
+      if (pthread_create(&th[i], NULL, run[k], (void *)&p) != 0) {
+        perror("Error launching thread");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // Sample queue occupancy every 10ms, reporting progress as we go.
+  do {
+    nanosleep(&tick, NULL);
+    finished = atomic_load(&p.active) == 0;
+    ring_sample(&p.to_color);
+    ring_sample(&p.to_write);
+    if (++ticks % 10 == 0 || finished)
+      progress_report(&progress, atomic_load(&p.rows_written), finished);
+  } while (!finished);
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_join(th[i], NULL) != 0) {
+      perror("Error joining thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  wall = (now_ns() - start) / 1e9;
+
+  fprintf(stderr, "Pipeline: %lu tiles of %u rows in %.2fs\n",
+          atomic_load(&p.write.tiles), tq->tile_rows, wall);
+  for (k = 0; k < 3; k++)
+    stage_report(stages[k], wall);
+  fputs("Queue occupancy:\n", stderr);
+  ring_report("color", &p.to_color);
+  ring_report("write", &p.to_write);
+
+  for (i = 0; i < ntiles; i++) {
+    free(tiles[i].c);
+    free(tiles[i].bgr);
+  }
+  free(tiles);
+  free(th);
+  free(p.spare.cells);
+  free(p.to_color.cells);
+  free(p.to_write.cells);
+  return atomic_load(&p.failed) ? -1 : 0;
+}
+
+/* Distributed rendering. A coordinator splits the image into tiles of
+ * consecutive rows and hands them out to worker processes ("mp --worker")
+ * connected over a local socket. Workers are stateless: the palette is sent
+ * once after the worker starts, and every job carries the view it belongs to.
+ * Messages are raw structs, so coordinator and workers must share an ABI. */
+
+// Give up on the render if a tile kills this many workers.
+#define MAX_TILE_ATTEMPTS 3
+// Stop replacing a worker slot after it has crashed this many times.
+#define MAX_WORKER_RESPAWNS 3
+
+typedef struct {
+  double rlo, ilo, stepu, stepv;
+  int64_t frlo, filo, fstepu, fstepv;
+  uint32_t xres, maxit, ymin, ymax, kernel;
+} Job_msg;
+
+typedef struct {
+  uint32_t ymin, ymax;
+} Result_msg;
+
+typedef struct {
+  pid_t pid;
+  int fd, tile;
+  unsigned int respawns;
+  // When the current tile was handed out, from now_ns().
+  unsigned long dispatched;
+} Worker;
+
+typedef struct {
+  const char *progname;
+  const Global_var *gv;
+  unsigned int yres, tile_rows, ntiles, nworkers, tile_timeout;
+  Worker *workers;
+  unsigned int *pending, npending;
+  unsigned char *attempts;
+} Coordinator;
+
+// Worker side: read the palette, then render jobs until the coordinator
+// closes the connection.
+int worker_main(void) {
+  Global_var gv;
+  Job_msg job;
+  Result_msg res;
+  uint32_t ncolor;
+  size_t n, cap = 0;
+  int *c = NULL;
+  unsigned char *framebuffer = NULL;
+
+  // Ctrl-C reaches the whole process group; let the coordinator decide.
+  signal(SIGINT, SIG_IGN);
+
+  if (read_full(STDIN_FILENO, &ncolor, sizeof(ncolor)) < 0 || ncolor == 0)
+    return EXIT_FAILURE;
+  gv.ncolor = ncolor;
+  gv.tr = (unsigned int *)malloc(ncolor * sizeof(unsigned int));
+  gv.tg = (unsigned int *)malloc(ncolor * sizeof(unsigned int));
+  gv.tb = (unsigned int *)malloc(ncolor * sizeof(unsigned int));
+  if (gv.tr == NULL || gv.tg == NULL || gv.tb == NULL) {
+    perror("Error allocating memory");
+    return EXIT_FAILURE;
+  }
+  if (read_full(STDIN_FILENO, gv.tr, ncolor * sizeof(unsigned int)) < 0 ||
+      read_full(STDIN_FILENO, gv.tg, ncolor * sizeof(unsigned int)) < 0 ||
+      read_full(STDIN_FILENO, gv.tb, ncolor * sizeof(unsigned int)) < 0)
+    return EXIT_FAILURE;
+
+  while (read_full(STDIN_FILENO, &job, sizeof(job)) == 0) {
+    gv.rlo = job.rlo;
+    gv.ilo = job.ilo;
+    gv.stepu = job.stepu;
+    gv.stepv = job.stepv;
+    gv.kernel = job.kernel;
+    gv.frlo = job.frlo;
+    gv.filo = job.filo;
+    gv.fstepu = job.fstepu;
+    gv.fstepv = job.fstepv;
+    gv.xres = job.xres;
+    gv.maxit = job.maxit;
+
+    n = (size_t)(job.ymax - job.ymin) * job.xres;
+    if (n > cap) {
+      free(c);
+      free(framebuffer);
+      c = (int *)malloc(n * sizeof(int));
+      framebuffer = (unsigned char *)malloc(3 * n);
+      if (c == NULL || framebuffer == NULL) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+      }
+      cap = n;
+    }
+    escape_rows(&gv, job.ymin, job.ymax, c, NULL);
+    color_rows(&gv, c, job.ymax - job.ymin, framebuffer);
+
+    res.ymin = job.ymin;
+    res.ymax = job.ymax;
+    if (write_full(STDOUT_FILENO, &res, sizeof(res)) < 0 ||
+        write_full(STDOUT_FILENO, framebuffer, 3 * n) < 0)
+      return EXIT_FAILURE;
+  }
+
+  free(c);
+  free(framebuffer);
+  free(gv.tr);
+  free(gv.tg);
+  free(gv.tb);
+  return EXIT_SUCCESS;
+}
+
+// Start a worker process talking to us over a socketpair on its
+// stdin/stdout, and send it the palette.
+int spawn_worker(Coordinator *co, Worker *w) {
+  uint32_t ncolor = co->gv->ncolor;
+  struct timeval tv;
+  int sv[2];
+
+  w->fd = -1;
+  w->pid = -1;
+  w->tile = -1;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return -1;
+  // Keep other workers from inheriting this end.
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+  if ((w->pid = fork()) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    w->pid = -1;
+    return -1;
+  }
+  if (w->pid == 0) {
+    dup2(sv[1], STDIN_FILENO);
+    dup2(sv[1], STDOUT_FILENO);
+    if (sv[1] > STDOUT_FILENO)
+      close(sv[1]);
+    // Workers must be this very build, whatever argv[0] says.
+#ifdef __linux__
+    execl("/proc/self/exe", co->progname, "--worker", (char *)NULL);
+#endif
+    execlp(co->progname, co->progname, "--worker", (char *)NULL);
+    perror("Error launching worker");
+    _exit(127);
+  }
+  close(sv[1]);
+  w->fd = sv[0];
+  // A worker that stops halfway through a result must not block us either.
+  if (co->tile_timeout > 0) {
+    tv.tv_sec = co->tile_timeout;
+    tv.tv_usec = 0;
+    setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  if (write_full(w->fd, &ncolor, sizeof(ncolor)) < 0 ||
+      write_full(w->fd, co->gv->tr, ncolor * sizeof(unsigned int)) < 0 ||
+      write_full(w->fd, co->gv->tg, ncolor * sizeof(unsigned int)) < 0 ||
+      write_full(w->fd, co->gv->tb, ncolor * sizeof(unsigned int)) < 0)
+    return -1;
+  return 0;
+}
+
+// Close our end of a worker's socket and make sure the process is gone.
+void reap_worker(Worker *w) {
+  if (w->fd >= 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+  if (w->pid > 0) {
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+    w->pid = -1;
+  }
+}
+
+// Reap a failed worker, put its tile back in the queue and start a
+// replacement. Returns -1 if the tile has failed too many times.
+int worker_failed(Coordinator *co, Worker *w) {
+  int tile = w->tile;
+
+  fprintf(stderr, "Worker %ld failed", (long)w->pid);
+  reap_worker(w);
+
+  if (tile >= 0) {
+    fprintf(stderr, " on rows starting at %u", tile * co->tile_rows);
+    if (++co->attempts[tile] >= MAX_TILE_ATTEMPTS) {
+      fprintf(stderr, ", giving up after %d attempts\n", MAX_TILE_ATTEMPTS);
+      return -1;
+    }
+    co->pending[co->npending++] = tile;
+  }
+  fputs(", retrying\n", stderr);
+
+  while (w->respawns < MAX_WORKER_RESPAWNS) {
+    w->respawns++;
+    if (spawn_worker(co, w) == 0)
+      return 0;
+    reap_worker(w);
+  }
+  return 0;
+}
+
+// Render the view described by gv with nworkers worker processes, writing
+// each tile's rows straight to their offset in the BMP open on out_fd. If
+// tile_timeout is not 0, a worker that takes more than tile_timeout seconds
+// over a tile is replaced.
+// Returns 1 if the render was cancelled, -1 on failure.
+int coordinate(const char *progname, const Global_var *gv, unsigned int yres,
+               unsigned int tile_rows, unsigned int nworkers,
+               unsigned int tile_timeout, int out_fd, Progress *progress) {
+  Coordinator co;
+  Job_msg job;
+  Result_msg res;
+  struct pollfd *pfd;
+  unsigned int i, k, n, done = 0, alive, ymin, ymax;
+  unsigned long rows_done = 0;
+  unsigned char *rows;
+  size_t len;
+  int ret = -1;
+
+  co.progname = progname;
+  co.gv = gv;
+  co.yres = yres;
+  co.tile_rows = tile_rows;
+  co.ntiles = (yres + tile_rows - 1) / tile_rows;
+  co.nworkers = nworkers;
+  co.tile_timeout = tile_timeout;
+  co.workers = (Worker *)calloc(nworkers, sizeof(Worker));
+  co.pending = (unsigned int *)malloc(co.ntiles * sizeof(unsigned int));
+  co.attempts = (unsigned char *)calloc(co.ntiles, 1);
+  pfd = (struct pollfd *)malloc(nworkers * sizeof(struct pollfd));
+  rows = (unsigned char *)malloc(3 * (size_t)gv->xres * tile_rows);
+  if (co.workers == NULL || co.pending == NULL || co.attempts == NULL ||
+      pfd == NULL || rows == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
 
-  for (y = ymin; y < ymax; y++) {
-    u = rlo;
-    for (x = 0; x < xres; x++) {
-      r1 = u;
-      i1 = v;
+  // Hand out tiles top to bottom.
+  co.npending = co.ntiles;
+  for (i = 0; i < co.ntiles; i++)
+    co.pending[i] = co.ntiles - 1 - i;
+
+  // A dead worker must not take the coordinator down with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  job.rlo = gv->rlo;
+  job.ilo = gv->ilo;
+  job.stepu = gv->stepu;
+  job.stepv = gv->stepv;
+  job.kernel = gv->kernel;
+  job.frlo = gv->frlo;
+  job.filo = gv->filo;
+  job.fstepu = gv->fstepu;
+  job.fstepv = gv->fstepv;
+  job.xres = gv->xres;
+  job.maxit = gv->maxit;
+
+  for (k = 0; k < nworkers; k++) {
+    co.workers[k].fd = -1;
+    co.workers[k].pid = -1;
+    if (spawn_worker(&co, &co.workers[k]) < 0 &&
+        worker_failed(&co, &co.workers[k]) < 0)
+      goto out;
+  }
 
-      // Iterate until either maxit is reached, or abs value > 2.0.
-      // c array counts iterations.
-      c[i] = 0;
-      r2 = 0.0;
-      i2 = 0.0;
-      while (r2 * r2 + i2 * i2 < 4.0 && c[i] <= maxit) {
-        r2 = r1 * r1 - i1 * i1 + u;
-        i2 = 2.0 * i1 * r1 + v;
-        c[i]++;
-        r1 = r2;
-        i1 = i2;
+  while (done < co.ntiles) {
+    if (atomic_load(&cancel_signal)) {
+      ret = 1;
+      goto out;
+    }
+
+    // Give every idle worker a tile.
+    alive = 0;
+    n = 0;
+    for (k = 0; k < nworkers; k++) {
+      Worker *w = &co.workers[k];
+
+      if (w->fd >= 0 && w->tile < 0 && co.npending > 0) {
+        w->tile = co.pending[--co.npending];
+        job.ymin = w->tile * tile_rows;
+        job.ymax = job.ymin + tile_rows < yres ? job.ymin + tile_rows : yres;
+        w->dispatched = now_ns();
+        if (write_full(w->fd, &job, sizeof(job)) < 0 &&
+            worker_failed(&co, w) < 0)
+          goto out;
+      }
+      if (w->fd >= 0) {
+        alive++;
+        if (w->tile >= 0) {
+          pfd[n].fd = w->fd;
+          pfd[n].events = POLLIN;
+          pfd[n].revents = 0;
+          n++;
+        }
       }
-      u += stepu;
-      // Find minimum number of iterations taken.
-      // in order to scale color range.
-      j = c[i] < j ? c[i] : j;
-      i++;
     }
-    v += stepv;
-  }
+    if (alive == 0) {
+      fputs("All workers failed\n", stderr);
+      goto out;
+    }
+    if (n == 0)
+      continue;
+
+    // Wake up now and then to report progress.
+    if (poll(pfd, n, 100) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error waiting for workers");
+      goto out;
+    }
 
-  ta->j = j;
-  // Assign a color to each pixel.
-  i = ymin * xres;
-  j = xres * 3 * ymin;
-  for (y = ymin; y < ymax; y++) {
-    for (x = 0; x < xres; x++) {
-      if (c[i] > maxit) {
-        r = 0;
-        g = 0;
-        b = 0;
-      } else {
-        index = c[i] % ncolor;
-        r = tr[index];
-        g = tg[index];
-        b = tb[index];
+    for (i = 0; i < n; i++) {
+      Worker *w = NULL;
+
+      if (pfd[i].revents == 0)
+        continue;
+      for (k = 0; k < nworkers; k++)
+        if (co.workers[k].fd == pfd[i].fd)
+          w = &co.workers[k];
+
+      ymin = w->tile * tile_rows;
+      ymax = ymin + tile_rows < yres ? ymin + tile_rows : yres;
+      len = 3 * (size_t)gv->xres * (ymax - ymin);
+      if (read_full(w->fd, &res, sizeof(res)) < 0 || res.ymin != ymin ||
+          res.ymax != ymax || read_full(w->fd, rows, len) < 0) {
+        if (worker_failed(&co, w) < 0)
+          goto out;
+        continue;
       }
-      i++;
+      if (pwrite_full(out_fd, rows, len,
+                      54 + 3 * (off_t)gv->xres * ymin) < 0) {
+        perror("Error writing bitmap file");
+        goto out;
+      }
+      w->tile = -1;
+      done++;
+      rows_done += ymax - ymin;
+    }
 
-      // Write pixel to file(RGB).
-      framebuffer[j++] = (unsigned char)b;
-      framebuffer[j++] = (unsigned char)g;
-      framebuffer[j++] = (unsigned char)r;
+    // A worker that is alive but stuck never hangs up, so time it out.
+    for (k = 0; k < nworkers; k++) {
+      Worker *w = &co.workers[k];
+
+      if (tile_timeout > 0 && w->fd >= 0 && w->tile >= 0 &&
+          now_ns() - w->dispatched > tile_timeout * 1000000000UL) {
+        fprintf(stderr, "Worker %ld timed out\n", (long)w->pid);
+        if (worker_failed(&co, w) < 0)
+          goto out;
+      }
     }
+    progress_report(progress, rows_done, 0);
   }
-  pthread_exit(NULL);
+  ret = 0;
+
+out:
+  progress_report(progress, rows_done, 1);
+  // Closing the socket tells an idle worker to exit.
+  for (k = 0; k < nworkers; k++) {
+    if (ret != 0) {
+      reap_worker(&co.workers[k]);
+    } else if (co.workers[k].fd >= 0) {
+      close(co.workers[k].fd);
+      waitpid(co.workers[k].pid, NULL, 0);
+    }
+  }
+  free(co.workers);
+  free(co.pending);
+  free(co.attempts);
+  free(pfd);
+  free(rows);
+  return ret;
 }
 
 void usage(const char *progname, FILE *stream) {
@@ -142,7 +1703,23 @@ void usage(const char *progname, FILE *stream) {
       "float:float\n"
       "\t-i, --iter\tnumber of iterations - int\n"
       "\t-o, --output\tfilepath to save image to - file path\n"
-      "\t-t\t\tnumber of threads to use\n",
+      "\t-t\t\tnumber of threads to use\n"
+      "\t--workers N\trender in N worker processes instead of threads\n"
+      "\t--tile-rows N\trows per unit of work - int\n"
+      "\t--tile-timeout S\treplace a worker that spends more than S "
+      "seconds on a tile, 0 for never (default) - int\n"
+      "\t--checkpoint FILE\tjournal finished tiles to FILE - file path\n"
+      "\t--resume-checkpoint FILE\tresume from the journal in FILE, if any - "
+      "file path\n"
+      "\t--progress FORMAT\treport progress on stderr - text or json\n"
+      "\t--budget-ms MS\trender for about MS milliseconds, raising the "
+      "iterations up to --iter - int\n"
+      "\t--batch FILE\trender every view listed in FILE, one set of options "
+      "per line - file path\n"
+      "\t--kernel KERNEL\tdouble (fastest) or fixed (same output on every "
+      "machine)\n"
+      "\t--pipeline C:K:W\trender through a pipeline with C compute, K color "
+      "and W write threads - int:int:int\n",
       progname);
 }
 
@@ -153,20 +1730,20 @@ typedef struct {
   char *palette;
   int optind;
   unsigned threads;
+  unsigned workers, tile_rows;
+  int worker;
+  char *checkpoint;
+  int resume;
+  int progress;
+  unsigned budget_ms;
+  char *batch;
+  int kernel;
+  unsigned stage_threads[3];
+  unsigned tile_timeout;
 } ParsedArgs;
 
-ParsedArgs parse_args(int argc, char *argv[]) {
-  ParsedArgs parsed_args = {0,
-                            0,
-                            0,
-                            FLT_MAX,
-                            FLT_MAX,
-                            FLT_MAX,
-                            FLT_MAX,
-                            "output.bmp",
-                            "palette",
-                            0,
-                            sysconf(_SC_NPROCESSORS_ONLN)};
+// Parse options from argv into parsed_args, overriding what is already set.
+void parse_options(ParsedArgs *parsed_args, int argc, char *argv[]) {
   int c, option_index = 0;
   char *endptr;
 
@@ -180,6 +1757,17 @@ ParsedArgs parse_args(int argc, char *argv[]) {
       {"output", required_argument, NULL, 'o'},
       {"palette", required_argument, NULL, 'p'},
       {"threads", required_argument, NULL, 't'},
+      {"workers", required_argument, NULL, 'w'},
+      {"tile-rows", required_argument, NULL, 'T'},
+      {"worker", no_argument, NULL, 'W'},
+      {"tile-timeout", required_argument, NULL, 'O'},
+      {"checkpoint", required_argument, NULL, 'k'},
+      {"resume-checkpoint", required_argument, NULL, 'K'},
+      {"progress", required_argument, NULL, 'P'},
+      {"budget-ms", required_argument, NULL, 'B'},
+      {"batch", required_argument, NULL, 'b'},
+      {"kernel", required_argument, NULL, 'F'},
+      {"pipeline", required_argument, NULL, 'L'},
       {NULL, 0, NULL, 0}};
 
   /* optstring is a string containing the legitimate option characters. If
@@ -192,64 +1780,145 @@ ParsedArgs parse_args(int argc, char *argv[]) {
       usage(argv[0], stdout);
       exit(EXIT_SUCCESS);
     case 'h':
-      parsed_args.xres = strtol(optarg, &endptr, 0);
+      parsed_args->xres = strtol(optarg, &endptr, 0);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
     case 'v':
-      parsed_args.yres = strtol(optarg, &endptr, 0);
+      parsed_args->yres = strtol(optarg, &endptr, 0);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
     case 'r':
-      parsed_args.rlo = strtof(optarg, &endptr);
+      parsed_args->rlo = strtof(optarg, &endptr);
       if (*endptr != ':') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       optarg = endptr + 1;
-      parsed_args.rhi = strtof(optarg, &endptr);
+      parsed_args->rhi = strtof(optarg, &endptr);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
     case 'c':
-      parsed_args.ilo = strtof(optarg, &endptr);
+      parsed_args->ilo = strtof(optarg, &endptr);
       if (*endptr != ':') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       optarg = endptr + 1;
-      parsed_args.ihi = strtof(optarg, &endptr);
+      parsed_args->ihi = strtof(optarg, &endptr);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
     case 'i':
-      parsed_args.maxit = strtol(optarg, &endptr, 0);
+      parsed_args->maxit = strtol(optarg, &endptr, 0);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
     case 't':
-      parsed_args.threads = strtol(optarg, &endptr, 0);
+      parsed_args->threads = strtol(optarg, &endptr, 0);
+      if (*endptr != '\0') {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      parsed_args->workers = strtol(optarg, &endptr, 0);
+      if (*endptr != '\0') {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'T':
+      parsed_args->tile_rows = strtol(optarg, &endptr, 0);
+      if (*endptr != '\0' || parsed_args->tile_rows == 0) {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'W':
+      parsed_args->worker = 1;
+      break;
+    case 'O':
+      parsed_args->tile_timeout = strtol(optarg, &endptr, 0);
+      if (*endptr != '\0') {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'k':
+      parsed_args->checkpoint = optarg;
+      parsed_args->resume = 0;
+      break;
+    case 'K':
+      parsed_args->checkpoint = optarg;
+      parsed_args->resume = 1;
+      break;
+    case 'B':
+      parsed_args->budget_ms = strtol(optarg, &endptr, 0);
       if (*endptr != '\0') {
         usage(argv[0], stderr);
         exit(EXIT_FAILURE);
       }
       break;
+    case 'P':
+      if (strcmp(optarg, "text") == 0) {
+        parsed_args->progress = PROGRESS_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        parsed_args->progress = PROGRESS_JSON;
+      } else {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'b':
+      parsed_args->batch = optarg;
+      break;
+    case 'L':
+      parsed_args->stage_threads[0] = strtol(optarg, &endptr, 0);
+      if (*endptr != ':') {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      parsed_args->stage_threads[1] = strtol(endptr + 1, &endptr, 0);
+      if (*endptr != ':') {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      parsed_args->stage_threads[2] = strtol(endptr + 1, &endptr, 0);
+      if (*endptr != '\0' || parsed_args->stage_threads[0] == 0 ||
+          parsed_args->stage_threads[1] == 0 ||
+          parsed_args->stage_threads[2] == 0) {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'F':
+      if (strcmp(optarg, "double") == 0) {
+        parsed_args->kernel = KERNEL_DOUBLE;
+      } else if (strcmp(optarg, "fixed") == 0) {
+        parsed_args->kernel = KERNEL_FIXED;
+      } else {
+        usage(argv[0], stderr);
+        exit(EXIT_FAILURE);
+      }
+      break;
     case 'o':
-      parsed_args.output = optarg;
+      parsed_args->output = optarg;
       break;
     case 'p':
-      parsed_args.palette = optarg;
+      parsed_args->palette = optarg;
       break;
     case ':':
       fputs("missing argument", stderr);
@@ -258,24 +1927,45 @@ ParsedArgs parse_args(int argc, char *argv[]) {
       exit(EXIT_FAILURE);
     }
   }
-  parsed_args.optind = optind;
+  parsed_args->optind = optind;
+}
+
+ParsedArgs parse_args(int argc, char *argv[]) {
+  ParsedArgs parsed_args = {0,
+                            0,
+                            0,
+                            FLT_MAX,
+                            FLT_MAX,
+                            FLT_MAX,
+                            FLT_MAX,
+                            "output.bmp",
+                            "palette",
+                            0,
+                            sysconf(_SC_NPROCESSORS_ONLN),
+                            0,
+                            16,
+                            0,
+                            NULL,
+                            0,
+                            PROGRESS_NONE,
+                            0,
+                            NULL,
+                            KERNEL_DOUBLE,
+                            {0, 0, 0},
+                            0};
 
+  parse_options(&parsed_args, argc, argv);
   return parsed_args;
 }
 
-int main(int argc, char *argv[]) {
-  int i, index, ncolor, *c, n, maxit, pad;
-  unsigned int xres, yres;
-  unsigned int *tr, *tg, *tb, buf, filesize;
-  double rlo, rhi, ilo, ihi, stepu, stepv;
-  FILE *fp, *fo;
-  unsigned char *framebuffer;
-  Thread_arg *ta;
-  Global_var gv;
-  ParsedArgs args = parse_args(argc, argv);
+// Read the palette at path into gv's ncolor, tr, tg and tb.
+void load_palette(const char *path, Global_var *gv) {
+  FILE *fp;
+  int i, n, ncolor;
+  unsigned int *tr, *tg, *tb;
 
   // Determine how many colors in color palette.
-  if ((fp = fopen(args.palette, "r")) == NULL) {
+  if ((fp = fopen(path, "r")) == NULL) {
     perror("Error opening palette file");
     exit(EXIT_FAILURE);
   }
@@ -303,15 +1993,369 @@ int main(int argc, char *argv[]) {
   memset(tb, 0, ncolor * sizeof(unsigned int));
 
   // Read in color palette.
-  if ((fp = fopen(args.palette, "r")) == NULL) {
-    perror("Error opening palette file");
+  for (i = 0; i < ncolor; i++)
+    fscanf(fp, "%*u %u %u %u", &tr[i], &tg[i], &tb[i]);
+  fclose(fp);
+
+  gv->ncolor = ncolor;
+  gv->tr = tr;
+  gv->tg = tg;
+  gv->tb = tb;
+}
+
+/* Batch rendering. Each line of the manifest holds the options of one view,
+ * as they would be given on the command line; options missing from a line
+ * are taken from the command line mp was started with. All views are
+ * rendered by one pool of threads that pulls tiles off the views in order,
+ * so the last tiles of one view overlap with the first tiles of the next and
+ * small views keep every thread busy. Buffers are recycled from one view to
+ * the next and each palette file is only read once. */
+
+typedef struct {
+  unsigned char *framebuffer;
+  int *c;
+  size_t cap;
+} Batch_buffer;
+
+typedef struct {
+  Global_var gv;
+  unsigned int yres, ntiles;
+  atomic_uint remaining;
+  const char *output;
+  Batch_buffer *buf;
+  char *line;
+} Batch_job;
+
+typedef struct {
+  Batch_job *jobs;
+  unsigned int njobs, tile_rows;
+  atomic_uint failed;
+  // Protects everything below.
+  pthread_mutex_t lock;
+  unsigned int job, tile;
+  Batch_buffer **spare;
+  unsigned int nspare;
+} Batch;
+
+// Write a complete bitmap of xres * yres BGR pixels to path.
+int write_BMP(const char *path, const unsigned char *framebuffer,
+              unsigned int xres, unsigned int yres) {
+  unsigned int filesize = xres * yres * 3u + 54u, pad = filesize % 4;
+  FILE *fo;
+
+  if ((fo = fopen(path, "wb")) == NULL)
+    return -1;
+  write_BMP_header(fo, filesize + pad, xres, yres);
+  fwrite(framebuffer, sizeof(unsigned char), 3 * (size_t)xres * yres, fo);
+  fwrite("\0\0\0", 1, pad, fo);
+  return fclose(fo) == 0 ? 0 : -1;
+}
+
+void *batch_thread(void *arg) {
+  Batch *b = (Batch *)arg;
+  Batch_job *job;
+  Batch_buffer *buf;
+  unsigned int tile, ymin, ymax;
+  size_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    if (b->job == b->njobs || atomic_load(&cancel_signal)) {
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+    job = &b->jobs[b->job];
+    if (b->tile == 0) {
+      // First tile of a view: give it a buffer.
+      n = (size_t)job->gv.xres * job->yres;
+      buf = b->nspare > 0 ? b->spare[--b->nspare]
+                          : (Batch_buffer *)calloc(1, sizeof(Batch_buffer));
+      if (buf != NULL && buf->cap < n) {
+        free(buf->framebuffer);
+        free(buf->c);
+        buf->framebuffer = (unsigned char *)malloc(3 * n);
+        buf->c = (int *)malloc(n * sizeof(int));
+        buf->cap = n;
+      }
+      if (buf == NULL || buf->framebuffer == NULL || buf->c == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+      }
+      job->buf = buf;
+      job->gv.framebuffer = buf->framebuffer;
+      job->gv.c = buf->c;
+    }
+    tile = b->tile;
+    if (++b->tile == job->ntiles) {
+      b->job++;
+      b->tile = 0;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    ymin = tile * b->tile_rows;
+    ymax = ymin + b->tile_rows < job->yres ? ymin + b->tile_rows : job->yres;
+    n = (size_t)ymin * job->gv.xres;
+    escape_rows(&job->gv, ymin, ymax, job->gv.c + n, NULL);
+    color_rows(&job->gv, job->gv.c + n, ymax - ymin,
+               job->gv.framebuffer + 3 * n);
+
+    // Whoever finishes the last tile writes the view out.
+    if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+      if (write_BMP(job->output, job->gv.framebuffer, job->gv.xres,
+                    job->yres) < 0) {
+        fprintf(stderr, "Error writing %s: %s\n", job->output,
+                strerror(errno));
+        atomic_fetch_add(&b->failed, 1);
+      }
+      pthread_mutex_lock(&b->lock);
+      b->spare[b->nspare++] = job->buf;
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// Turn one manifest line into a job. Returns -1, after saying why, if the
+// line is too long, sets an option that only applies to the whole batch or
+// leaves the view incomplete.
+int batch_parse_line(const char *progname, char *line, unsigned long lineno,
+                     const ParsedArgs *base, ParsedArgs *job_args) {
+  char *argv[64], *tok;
+  int argc = 0;
+
+  argv[argc++] = (char *)progname;
+  for (tok = strtok(line, " \t\r\n"); tok != NULL;
+       tok = strtok(NULL, " \t\r\n")) {
+    if (argc == 63) {
+      fprintf(stderr, "%s:%lu: more than 62 arguments\n", base->batch, lineno);
+      return -1;
+    }
+    argv[argc++] = tok;
+  }
+  argv[argc] = NULL;
+
+  *job_args = *base;
+  // Rescan from the start of this line's arguments.
+  optind = 1;
+  parse_options(job_args, argc, argv);
+
+  if (optind < argc) {
+    fprintf(stderr, "%s:%lu: unexpected argument %s\n", base->batch, lineno,
+            argv[optind]);
+    return -1;
+  }
+  if (job_args->threads != base->threads ||
+      job_args->workers != base->workers ||
+      job_args->tile_rows != base->tile_rows ||
+      job_args->tile_timeout != base->tile_timeout ||
+      job_args->checkpoint != base->checkpoint ||
+      job_args->resume != base->resume ||
+      job_args->progress != base->progress ||
+      job_args->budget_ms != base->budget_ms ||
+      job_args->batch != base->batch ||
+      memcmp(job_args->stage_threads, base->stage_threads,
+             sizeof(base->stage_threads)) != 0) {
+    fprintf(stderr,
+            "%s:%lu: -t, --workers, --tile-rows, --tile-timeout, "
+            "--checkpoint, --resume-checkpoint, --progress, --budget-ms, "
+            "--pipeline and --batch cannot be set on a batch line\n",
+            base->batch, lineno);
+    return -1;
+  }
+  if (job_args->xres == 0 || job_args->yres == 0 || job_args->maxit == 0 ||
+      job_args->rlo == FLT_MAX || job_args->rhi == FLT_MAX ||
+      job_args->ilo == FLT_MAX || job_args->ihi == FLT_MAX) {
+    fprintf(stderr, "%s:%lu: view needs --hp, --vp, --ri, --ci and --iter\n",
+            base->batch, lineno);
+    return -1;
+  }
+  return 0;
+}
+
+int batch_main(const char *progname, const ParsedArgs *base) {
+  Batch b;
+  Batch_job *job;
+  ParsedArgs job_args;
+  Global_var *palettes = NULL;
+  const char **palette_paths = NULL;
+  unsigned int i, k, npalettes = 0, cap = 0, nthreads = base->threads;
+  char *line = NULL;
+  size_t linecap = 0, lineno = 0;
+  pthread_t *th;
+  struct timespec start, end;
+  double elapsed;
+  FILE *fp;
+
+  if ((fp = fopen(base->batch, "r")) == NULL) {
+    perror("Error opening batch file");
     exit(EXIT_FAILURE);
   }
 
-  for (i = 0; i < ncolor; i++)
-    fscanf(fp, "%*u %u %u %u", &tr[i], &tg[i], &tb[i]);
+  // Read the whole manifest up front so a bad line fails before any work.
+  b.jobs = NULL;
+  b.njobs = 0;
+  while (getline(&line, &linecap, fp) > 0) {
+    lineno++;
+    if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#')
+      continue;
+    if (b.njobs == cap) {
+      cap = cap ? 2 * cap : 64;
+      b.jobs = (Batch_job *)realloc(b.jobs, cap * sizeof(Batch_job));
+      palettes = (Global_var *)realloc(palettes, cap * sizeof(Global_var));
+      palette_paths =
+          (const char **)realloc(palette_paths, cap * sizeof(char *));
+      if (b.jobs == NULL || palettes == NULL || palette_paths == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+      }
+    }
+    // Options point into the line, so each job keeps its own copy.
+    job = &b.jobs[b.njobs];
+    if ((job->line = strdup(line)) == NULL) {
+      perror("Error allocating memory");
+      exit(EXIT_FAILURE);
+    }
+    if (batch_parse_line(progname, job->line, (unsigned long)lineno, base,
+                         &job_args) < 0)
+      exit(EXIT_FAILURE);
+
+    for (k = 0; k < npalettes; k++)
+      if (strcmp(palette_paths[k], job_args.palette) == 0)
+        break;
+    if (k == npalettes) {
+      load_palette(job_args.palette, &palettes[k]);
+      palette_paths[npalettes++] = job_args.palette;
+    }
+
+    b.njobs++;
+    job->gv = palettes[k];
+    job->gv.rlo = job_args.rlo;
+    job->gv.ilo = job_args.ilo;
+    job->gv.stepu = ((double)job_args.rhi - job_args.rlo) / job_args.xres;
+    job->gv.stepv = ((double)job_args.ihi - job_args.ilo) / job_args.yres;
+    job->gv.xres = job_args.xres;
+    job->gv.maxit = job_args.maxit;
+    job->gv.kernel = job_args.kernel;
+    if (job_args.kernel == KERNEL_FIXED &&
+        set_fixed_view(&job->gv, job_args.rlo, job_args.rhi, job_args.ilo,
+                       job_args.ihi, job_args.xres, job_args.yres) < 0) {
+      fprintf(stderr, "%s:%lu: view out of range for the fixed kernel\n",
+              base->batch, (unsigned long)lineno);
+      exit(EXIT_FAILURE);
+    }
+    job->yres = job_args.yres;
+    job->ntiles = (job_args.yres + base->tile_rows - 1) / base->tile_rows;
+    atomic_init(&job->remaining, job->ntiles);
+    job->output = job_args.output;
+    job->buf = NULL;
+  }
+  free(line);
   fclose(fp);
 
+  b.tile_rows = base->tile_rows;
+  b.job = 0;
+  b.tile = 0;
+  b.nspare = 0;
+  atomic_init(&b.failed, 0);
+  pthread_mutex_init(&b.lock, NULL);
+  // At most one view per thread plus the one being handed out is in flight.
+  b.spare = (Batch_buffer **)malloc((nthreads + 1) * sizeof(Batch_buffer *));
+  th = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  if (b.spare == NULL || th == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+
+  install_cancel_handler();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&th[i], NULL, &batch_thread, (void *)&b) != 0) {
+      perror("Error launching thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_join(th[i], NULL) != 0) {
+      perror("Error joining thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = elapsed_s(&start, &end);
+  fprintf(stderr, "Rendered %u views in %.3fs (%.1f views/s)\n", b.njobs,
+          elapsed, elapsed > 0 ? b.njobs / elapsed : 0.0);
+
+  for (i = 0; i < b.nspare; i++) {
+    free(b.spare[i]->framebuffer);
+    free(b.spare[i]->c);
+    free(b.spare[i]);
+  }
+  for (k = 0; k < npalettes; k++) {
+    free(palettes[k].tr);
+    free(palettes[k].tg);
+    free(palettes[k].tb);
+  }
+  for (i = 0; i < b.njobs; i++)
+    free(b.jobs[i].line);
+  pthread_mutex_destroy(&b.lock);
+  free(b.spare);
+  free(th);
+  free(palettes);
+  free(palette_paths);
+  free(b.jobs);
+
+  if ((k = atomic_load(&cancel_signal)) != 0)
+    return 128 + k;
+  return atomic_load(&b.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  int i, index, *c, n, maxit, pad, boundary;
+  unsigned int xres, yres;
+  unsigned int buf, filesize;
+  double rlo, rhi, ilo, ihi, stepu, stepv;
+  FILE *fo;
+  unsigned char *framebuffer;
+  Tile_queue tq;
+  Progress progress;
+  struct timespec start, end;
+  Global_var gv;
+  ParsedArgs args = parse_args(argc, argv);
+
+  if (args.worker)
+    return worker_main();
+  if (args.batch != NULL) {
+    if (args.workers > 0 || args.budget_ms > 0 || args.checkpoint != NULL ||
+        args.stage_threads[0] > 0 || args.progress != PROGRESS_NONE) {
+      fputs("--batch cannot be combined with --workers, --budget-ms, "
+            "checkpointing, --pipeline or --progress\n",
+            stderr);
+      exit(EXIT_FAILURE);
+    }
+    return batch_main(argv[0], &args);
+  }
+  if (args.workers > 0 && args.checkpoint != NULL) {
+    fputs("Checkpointing is not supported with --workers\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+  if (args.stage_threads[0] > 0 && (args.workers > 0 || args.budget_ms > 0 ||
+                                    args.checkpoint != NULL)) {
+    fputs("--pipeline cannot be combined with --workers, --budget-ms or "
+          "checkpointing\n",
+          stderr);
+    exit(EXIT_FAILURE);
+  }
+  if (args.budget_ms > 0 &&
+      (args.workers > 0 || args.checkpoint != NULL ||
+       args.kernel != KERNEL_DOUBLE || args.progress != PROGRESS_NONE)) {
+    fputs("--budget-ms cannot be combined with --workers, checkpointing, "
+          "--kernel fixed or --progress\n",
+          stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  load_palette(args.palette, &gv);
+
   // Ask for image dimensions(px).
   if (args.xres == 0) {
     do {
@@ -327,13 +2371,6 @@ int main(int argc, char *argv[]) {
   } else {
     yres = args.yres;
   }
-  framebuffer =
-      (unsigned char *)malloc(3 * xres * yres * sizeof(unsigned char));
-
-  // Allocate memory for the array containing iterations.
-  c = (int *)malloc(xres * yres * sizeof(int));
-  memset(c, 0, xres * yres * sizeof(int));
-
   // Ask for range on real scale
   if (args.rlo == FLT_MIN || args.rlo == FLT_MAX || args.rlo != args.rlo) {
     do {
@@ -367,7 +2404,9 @@ int main(int argc, char *argv[]) {
   }
 
   // Ask for maximum allowable number of iterations.
-  if (args.maxit == 0) {
+  if (args.maxit == 0 && args.budget_ms > 0) {
+    maxit = BUDGET_MAX_ITER;
+  } else if (args.maxit == 0) {
     do {
       printf("\nWhat is the maximum allowable number of iterations ?\n");
     } while (scanf("%i", &maxit) == 0);
@@ -398,45 +2437,98 @@ int main(int argc, char *argv[]) {
   // Plot selected area, iterating on each point.
   // Pixels are in(x,y) plane.
 
-  /* start threaded mandlebrot construction */
-  index = args.threads;
-  ta = (Thread_arg *)alloca(sizeof(Thread_arg) * index);
-  gv.framebuffer = framebuffer;
   gv.rlo = rlo;
   gv.ilo = ilo;
   gv.stepu = stepu;
   gv.stepv = stepv;
   gv.xres = xres;
-  gv.c = c;
   gv.maxit = maxit;
-  gv.ncolor = ncolor;
-  gv.tr = tr;
-  gv.tg = tg;
-  gv.tb = tb;
-
-  for (i = 0; i < index; i++) {
-    ta[i].gv = gv;
-    ta[i].ymin = i * (yres / index);
-    ta[i].ymax = (i + 1) * (yres / index);
-    ta[i].id = i;
+  gv.kernel = args.kernel;
+  if (gv.kernel == KERNEL_FIXED &&
+      set_fixed_view(&gv, rlo, rhi, ilo, ihi, xres, yres) < 0) {
+    fprintf(stderr, "The fixed kernel needs a view within %g of 0\n",
+            FIX_RANGE);
+    exit(EXIT_FAILURE);
   }
-  ta[index - 1].ymax = yres;
 
-  for (i = 0; i < index; i++) {
-    if (pthread_create(&ta[i].th, NULL, &threaded_mp, (void *)&ta[i]) != 0) {
-      perror("Error launching thread");
+  tq.journal = NULL;
+  install_cancel_handler();
+
+  if (args.workers > 0) {
+    // Workers write their rows directly into the file, so no framebuffer.
+    fflush(fo);
+    fcntl(fileno(fo), F_SETFD, FD_CLOEXEC);
+    progress_start(&progress, args.progress, yres);
+    if (coordinate(argv[0], &gv, yres, args.tile_rows, args.workers,
+                   args.tile_timeout, fileno(fo), &progress) < 0)
+      exit(EXIT_FAILURE);
+    // Tiles were written in place, so a cancelled render stops short of
+    // the end; size the file so that the rows never written read as black.
+    if (ftruncate(fileno(fo), filesize) < 0) {
+      perror("Error writing output file");
       exit(EXIT_FAILURE);
     }
+    goto finish;
   }
 
-  for (i = 0; i < index; i++) {
-    if (pthread_join(ta[i].th, NULL) != 0) {
-      perror("Error joining thread");
+  if (args.stage_threads[0] > 0) {
+    // The write stage puts tiles straight into the file.
+    fflush(fo);
+    tq.yres = yres;
+    tq.tile_rows = args.tile_rows;
+    tq.ntiles = (yres + tq.tile_rows - 1) / tq.tile_rows;
+    atomic_init(&tq.next, 0);
+    if (render_pipeline(&gv, &tq, args.stage_threads, fileno(fo),
+                        args.progress) < 0)
+      exit(EXIT_FAILURE);
+    if (ftruncate(fileno(fo), filesize) < 0) {
+      perror("Error writing output file");
+      exit(EXIT_FAILURE);
+    }
+    goto finish;
+  }
+
+  // Zeroed so that rows left unrendered by a cancellation come out black.
+  framebuffer =
+      (unsigned char *)calloc(3 * xres * yres, sizeof(unsigned char));
+
+  // Allocate memory for the array containing iterations.
+  c = (int *)malloc(xres * yres * sizeof(int));
+  memset(c, 0, xres * yres * sizeof(int));
+
+  /* start threaded mandlebrot construction */
+  index = args.threads;
+  gv.framebuffer = framebuffer;
+  gv.c = c;
+
+  tq.yres = yres;
+  tq.tile_rows = args.tile_rows;
+  atomic_init(&tq.next, 0);
+  if (args.checkpoint != NULL) {
+    tq.journal = journal_open(args.checkpoint, args.resume, &gv, yres, &tq);
+  } else {
+    tq.ntiles = (yres + tq.tile_rows - 1) / tq.tile_rows;
+    if ((tq.done = (unsigned char *)calloc(tq.ntiles, 1)) == NULL) {
+      perror("Error allocating memory");
       exit(EXIT_FAILURE);
     }
   }
 
+  if (args.budget_ms > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = render_budget(&gv, &tq, yres, index, args.budget_ms, &boundary);
+    color_rows(&gv, c, yres, framebuffer);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Reached maxit %d (%d on the boundary) in %.0f ms\n", n,
+            boundary, elapsed_s(&start, &end) * 1e3);
+  } else {
+    render_threads(&gv, &tq, index, args.progress);
+  }
+
   fwrite(framebuffer, sizeof(unsigned char), 3 * xres * yres, fo);
+  free(framebuffer);
+  free(c);
+  free(tq.done);
 
   // Add file padding to reach 4-byte boundary.
   buf = 0;
@@ -444,16 +2536,27 @@ int main(int argc, char *argv[]) {
     fputc(buf, fo);
   }
 
+finish:
   // Close file descriptor.
+  if (fflush(fo) == 0 && fsync(fileno(fo)) == 0 && tq.journal != NULL &&
+      !atomic_load(&cancel_signal)) {
+    // The bitmap is complete, so the checkpoint is no longer needed.
+    unlink(args.checkpoint);
+  }
   fclose(fo);
+  if (tq.journal != NULL)
+    journal_close(tq.journal);
 
   // Free allocated memory.
-  free(framebuffer);
-  free(tr);
-  free(tg);
-  free(tb);
-  free(c);
-
+  free(gv.tr);
+  free(gv.tg);
+  free(gv.tb);
+
+  if ((n = atomic_load(&cancel_signal)) != 0) {
+    fprintf(stderr, "Render cancelled, partial image written to %s\n",
+            args.output);
+    return 128 + n;
+  }
   return (EXIT_SUCCESS);
 }
 